@@ -1,11 +1,21 @@
 #include "hv/HttpMessage.h"
 #include "hv/hstring.h"
+#include "memory.cpp"
 #include "message_reader.cpp"
+#include "search_index.cpp"
+#include "snapshot.cpp"
+#include "trace.cpp"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
 #include <cstdio>
+#include <deque>
 #include <format>
+#include <hv/EventLoop.h>
 #include <hv/WebSocketChannel.h>
 #include <hv/WebSocketServer.h>
 #include <libuuidpp.hpp>
+#include <set>
 #include <string>
 
 using namespace std;
@@ -35,23 +45,100 @@ RoomPermission permission_from_string(string perm) {
   return string_perm_map.at(perm);
 }
 
+string permission_to_string(RoomPermission perm) {
+  for (auto &it : string_perm_map) {
+    if (it.second == perm)
+      return it.first;
+  }
+  return "none";
+}
+
+// outbound/inbound priority classes, serviced in order
+enum Lane {
+  CONTROL,
+  CHAT,
+
+  LANE_COUNT,
+};
+
 map<int, Context *> ACTIVE_CONTEXT = {};
+// every room ever created, rooms are never freed
+map<uuid, Room *> ROOM_REGISTRY = {};
+// set whenever something the admin API reports changes
+static bool SNAPSHOT_DIRTY = true;
+// rooms and users (by id) changed since the last published snapshot
+static set<Room *> SNAPSHOT_ROOMS;
+static set<int> SNAPSHOT_USERS;
+static map<string, int> NICK_TO_ID;
+
+// number of direct message partners remembered per context
+const size_t RECENT_DM_LIMIT = 8;
+// how long a dropped connection's context is kept around for `/resume`
+const chrono::seconds SESSION_GRACE_PERIOD(120);
+// how often each event loop drops expired sessions
+const chrono::milliseconds SESSION_SWEEP_INTERVAL(1000);
+// messages queued for a suspended context (direct messages, invites) before dropping the oldest
+const size_t SESSION_BACKLOG_LIMIT = 256;
+// broadcast messages each room retains for replay on resume
+const size_t ROOM_HISTORY_LIMIT = 256;
+
+// queue outbound frames instead of writing once a channel has this many bytes unsent
+const size_t OUTBOUND_HIGH_WATER = 64 * 1024;
+// consecutive control frames/commands serviced before a waiting chat one gets a turn
+const size_t CONTROL_STREAK_LIMIT = 16;
+// inbound messages processed per event loop iteration
+const size_t INBOUND_BATCH_LIMIT = 256;
+
+// minimum time between two published admin API snapshots
+const chrono::milliseconds SNAPSHOT_INTERVAL(250);
+
+// members listed by `/members` when no limit is given, and the most it lists at once
+const size_t MEMBERS_PAGE_LIMIT = 200;
+
+// memory budgets, overridable from the environment at startup
+MemoryBudget CONTEXT_MEMORY_BUDGET{.soft = 256 * 1024, .hard = 4 * 1024 * 1024};
+MemoryBudget ROOM_MEMORY_BUDGET{.soft = 4 * 1024 * 1024, .hard = 64 * 1024 * 1024};
+
+// suspended contexts by session token
+map<string, Context *> SUSPENDED = {};
 
 class Context {
 public:
-  const WebSocketChannelPtr &channel;
+  WebSocketChannelPtr channel;
   string nickname;
   bool is_active;
+  // charged for everything below and for queued message text
+  MemoryAccount memory{&MEMORY_TOTALS.contexts, &CONTEXT_MEMORY_BUDGET};
+  // resumable session state
+  string token;
+  bool exited = false;
+  bool suspended = false;
+  chrono::steady_clock::time_point suspended_at;
+  accounted_deque<string> backlog{&memory};
+  // last room sequence number delivered before the connection dropped
+  accounted_map<uuid, uint64_t> seen{&memory};
+  // rendered `/rooms` reply, empty when stale
+  string rooms_reply;
+  // frames waiting for the channel's write buffer to drain
+  accounted_deque<string> outbound[LANE_COUNT]{accounted_deque<string>(&memory),
+                                               accounted_deque<string>(&memory)};
+  size_t control_streak = 0;
+  // set while `flush` is writing, in case the channel calls back into it
+  bool flushing = false;
   Room *room;
-  map<uuid, Room *> invites;
-  map<uuid, Room *> rooms;
+  accounted_map<uuid, Room *> invites{&memory};
+  accounted_map<uuid, Room *> rooms{&memory};
+  // most recent direct message partners (by id), newest first
+  accounted_deque<int> recent{&memory};
   explicit Context(const WebSocketChannelPtr &channel, Room *room, bool is_active = true)
       : channel(channel), room(room), is_active(is_active) {
     ACTIVE_CONTEXT.insert_or_assign(channel->id(), this);
   }
   virtual ~Context() {
-    if (this->is_active)
+    if (this->is_active) {
       ACTIVE_CONTEXT.erase(channel->id());
+      this->touch();
+    }
   };
   static Context *build(const WebSocketChannelPtr &channel, Room *default_room) {
     auto it = ACTIVE_CONTEXT.find(channel->id());
@@ -59,21 +146,104 @@ public:
       return it->second;
     }
     auto ctx = new Context(channel, default_room);
+    ctx->token = uuid::random().string();
     ctx->join(default_room, RoomPermission::Chat);
     return ctx;
   };
   int id() { return channel->id(); }
   void close();
   void join(Room *room, RoomPermission);
-  void leave(Room *room);
+  void leave(Room *room, bool announce = true);
+  void suspend();
+  void resume(Context *fresh, uint64_t last_seq);
 
   string nickOrId() { return this->nickname.empty() ? to_string(this->id()) : this->nickname; }
 
-  void send(string message) {
+  // something the admin API reports about this user changed
+  void touch() {
+    SNAPSHOT_USERS.insert(this->id());
+    SNAPSHOT_DIRTY = true;
+  }
+
+  void enqueue(accounted_deque<string> &queue, string message) {
+    this->memory.charge(message.size());
+    queue.push_back(std::move(message));
+  }
+
+  void dequeue(accounted_deque<string> &queue) {
+    this->memory.release(queue.front().size());
+    queue.pop_front();
+  }
+
+  void send(string message, Lane lane = CHAT) {
+    if (this->suspended) {
+      while (!this->backlog.empty() &&
+             (this->backlog.size() >= SESSION_BACKLOG_LIMIT || this->memory.over_hard())) {
+        this->dequeue(this->backlog);
+      }
+      this->enqueue(this->backlog, message);
+      return;
+    }
     if (this->channel->isClosed()) {
       return;
     }
-    this->channel->send(message);
+    if (this->outbound[CONTROL].empty() && this->outbound[CHAT].empty() &&
+        this->channel->writeBufsize() < OUTBOUND_HIGH_WATER) {
+      this->channel->send(message);
+      return;
+    }
+    this->enqueue(this->outbound[lane], message);
+    // a client that doesn't read loses its oldest chat first
+    while (this->memory.over_hard() && !this->outbound[CHAT].empty()) {
+      this->dequeue(this->outbound[CHAT]);
+    }
+    this->flush();
+  }
+
+  // write queued frames while the channel has room, control first but never more than
+  // `CONTROL_STREAK_LIMIT` in a row while chat is waiting
+  void flush() {
+    if (this->flushing) {
+      return;
+    }
+    this->flushing = true;
+    while (!this->channel->isClosed() && this->channel->writeBufsize() < OUTBOUND_HIGH_WATER) {
+      Lane lane;
+      if (!this->outbound[CONTROL].empty() &&
+          (this->outbound[CHAT].empty() || this->control_streak < CONTROL_STREAK_LIMIT)) {
+        lane = CONTROL;
+        this->control_streak++;
+      } else if (!this->outbound[CHAT].empty()) {
+        lane = CHAT;
+        this->control_streak = 0;
+      } else {
+        break;
+      }
+      // off the queue before writing, the write may complete (and call back) synchronously
+      string frame = std::move(this->outbound[lane].front());
+      this->memory.release(frame.size());
+      this->outbound[lane].pop_front();
+      this->channel->send(frame);
+    }
+    this->flushing = false;
+  }
+
+  // move `id` to the front of the recent conversation table
+  void touch_recent(int id) {
+    auto it = find(recent.begin(), recent.end(), id);
+    if (it != recent.end()) {
+      recent.erase(it);
+    } else if (recent.size() >= RECENT_DM_LIMIT) {
+      recent.pop_back();
+    }
+    recent.push_front(id);
+  }
+
+  // send `message` straight to `recv`, no room involved
+  void direct(Context *recv, string message) {
+    recv->send(format("@{}>@{}: {}", this->nickOrId(), recv->nickOrId(), message));
+    this->touch_recent(recv->id());
+    recv->touch_recent(this->id());
   }
 };
 
@@ -90,69 +260,304 @@ public:
 typedef struct RoomMember {
   Context *ctx;
   RoomPermission permission;
+  // rendered `/members` line
+  string line = "";
 } RoomMember;
 
+typedef struct RoomEvent {
+  uint64_t seq;
+  string line;
+} RoomEvent;
+
 class Room {
 public:
   uuid id;
   string name;
   Context *ctx;
-  map<int, RoomMember> members;
+  // charged for members, history and their text
+  MemoryAccount memory{&MEMORY_TOTALS.rooms, &ROOM_MEMORY_BUDGET};
+  accounted_map<int, RoomMember> members{&memory};
+  // ids of `members` in order, so `/members` can seek straight to an offset
+  accounted_vector<int> member_ids{&memory};
+  // sequence number of the last broadcast
+  uint64_t seq = 0;
+  accounted_deque<RoomEvent> history{&memory};
+  // shared with in-flight `/search` queries
+  shared_ptr<SearchIndex> index = make_shared<SearchIndex>();
+  string id_string;
+  // rendered first page of `/members`, empty when stale
+  string members_reply;
 
   Room(string name) : name(name) {
     this->id = uuid::random();
+    this->id_string = this->id.string();
+    ROOM_REGISTRY.insert_or_assign(this->id, this);
     auto noop = new NoopChannel();
     this->ctx = new Context(WebSocketChannelPtr(noop), this, false);
     this->ctx->nickname = "internal";
+    this->touch();
   }
 
   void join(RoomMember member) {
+    member.line = render_member(member.ctx);
+    auto it = this->members.find(member.ctx->id());
+    if (it != this->members.end()) {
+      this->memory.release(it->second.line.size());
+    }
+    this->memory.charge(member.line.size());
     this->members.insert_or_assign(member.ctx->id(), member);
+    this->index_member(member.ctx->id());
+    this->members_reply.clear();
+    this->touch();
+    member.ctx->touch();
     this->broadcast(this->ctx, std::format("@{} joined #{}", member.ctx->id(), this->nameOrId()));
   }
 
-  void leave(Context *ctx) {
-    members.erase(ctx->id());
-    this->broadcast(this->ctx, std::format("@{} left #{}", ctx->id(), this->nameOrId()));
+  void leave(Context *ctx, bool announce = true) {
+    auto it = this->members.find(ctx->id());
+    if (it != this->members.end()) {
+      this->memory.release(it->second.line.size());
+      this->members.erase(it);
+      this->unindex_member(ctx->id());
+    }
+    this->members_reply.clear();
+    this->touch();
+    ctx->touch();
+    if (announce) {
+      this->broadcast(this->ctx, std::format("@{} left #{}", ctx->id(), this->nameOrId()));
+    }
+  }
+
+  string nameOrId() { return this->name.empty() ? this->id_string : this->name; }
+
+  // membership, a member or the name changed. Broadcasts don't count, so a room's reported
+  // seq is as of its last change.
+  void touch() {
+    SNAPSHOT_ROOMS.insert(this);
+    SNAPSHOT_DIRTY = true;
+  }
+
+  void index_member(int id) {
+    auto it = lower_bound(this->member_ids.begin(), this->member_ids.end(), id);
+    if (it == this->member_ids.end() || *it != id) {
+      this->member_ids.insert(it, id);
+    }
+  }
+
+  void unindex_member(int id) {
+    auto it = lower_bound(this->member_ids.begin(), this->member_ids.end(), id);
+    if (it != this->member_ids.end() && *it == id) {
+      this->member_ids.erase(it);
+    }
+  }
+
+  static string render_member(Context *ctx) {
+    return format("\n  @{} ({})", ctx->nickOrId(), ctx->id());
+  }
+
+  // re-render the `/members` line of `ctx` after its nickname or id changed
+  void member_renamed(Context *ctx) {
+    auto it = this->members.find(ctx->id());
+    if (it == this->members.end()) {
+      return;
+    }
+    this->memory.release(it->second.line.size());
+    it->second.line = render_member(ctx);
+    this->memory.charge(it->second.line.size());
+    this->members_reply.clear();
+    this->touch();
+    ctx->touch();
+  }
+
+  void rename(string name) {
+    this->name = name;
+    this->touch();
+    for (auto &member : this->members) {
+      member.second.ctx->rooms_reply.clear();
+      member.second.ctx->touch();
+    }
   }
 
-  string nameOrId() { return this->name.empty() ? this->id.string() : this->name; }
+  string members_page(size_t offset, size_t limit) {
+    bool first_page = offset == 0 && limit == MEMBERS_PAGE_LIMIT;
+    if (first_page && !this->members_reply.empty()) {
+      return this->members_reply;
+    }
+    size_t size = this->member_ids.size();
+    size_t from = min(offset, size);
+    size_t to = from + min(limit, size - from);
+    string page = offset > 0 || size > limit
+                      ? format("Members ({}-{} of {}): ", from, to, size)
+                      : "Members: ";
+    for (size_t i = from; i < to; i++) {
+      page += this->members.at(this->member_ids[i]).line;
+    }
+    if (first_page) {
+      this->members_reply = page;
+    }
+    return page;
+  }
 
   void broadcast(Context *ctx, string message) {
+    TraceSpan span("broadcast");
     if (ctx != this->ctx && !this->members.contains(ctx->id())) {
       return;
     }
     if (ctx != this->ctx) {
-      auto sender = this->members.at(ctx->id());
+      const auto &sender = this->members.at(ctx->id());
       if (sender.permission > RoomPermission::Chat) {
         return;
       }
     }
+    auto seq = ++this->seq;
+    string line = format("[{}] #{}@{}: {}", seq, this->nameOrId(), ctx->nickOrId(), message);
+    while (!this->history.empty() &&
+           (this->history.size() >= ROOM_HISTORY_LIMIT || this->memory.over_soft())) {
+      this->memory.release(this->history.front().line.size());
+      this->history.pop_front();
+    }
+    this->memory.charge(line.size());
+    this->history.push_back(RoomEvent{.seq = seq, .line = line});
+    if (ctx != this->ctx) {
+      TraceSpan span("index");
+      this->index->add(message, line);
+    }
     for (auto &member : members) {
+      // suspended members catch up from `history` when they resume
+      if (member.second.ctx->suspended) {
+        continue;
+      }
       println(format("sending: {}", member.first));
-      member.second.ctx->send(format("#{}@{}: {}", this->nameOrId(), ctx->nickOrId(), message));
+      TraceSpan span("send");
+      member.second.ctx->send(line, ctx == this->ctx ? CONTROL : CHAT);
+    }
+  }
+
+  // send `ctx` every retained broadcast after `from`
+  void replay(Context *ctx, uint64_t from) {
+    if (from >= this->seq) {
+      return;
+    }
+    if (this->history.empty() || this->history.front().seq > from + 1) {
+      auto missed = (this->history.empty() ? this->seq + 1 : this->history.front().seq) - from - 1;
+      ctx->send(format("#{}: {} messages no longer available", this->nameOrId(), missed), CONTROL);
+    }
+    for (auto &event : this->history) {
+      if (event.seq > from) {
+        ctx->send(event.line);
+      }
     }
   }
 };
 
 void Context::close() {
+  this->exited = true;
   for (auto &room : this->rooms) {
     room.second->leave(this);
   }
   this->channel->close();
 }
 
+// keep the context (nickname, rooms, invites) alive for `SESSION_GRACE_PERIOD` after its
+// connection drops
+void Context::suspend() {
+  this->suspended = true;
+  this->suspended_at = chrono::steady_clock::now();
+  this->touch();
+  for (auto &room : this->rooms) {
+    this->seen.insert_or_assign(room.first, room.second->seq);
+  }
+  SUSPENDED.insert_or_assign(this->token, this);
+}
+
+// take over the connection of `fresh` (the context built for the reconnecting socket) and
+// deliver everything missed since the connection dropped. `last_seq` is the last sequence
+// number the client saw in its default room. `fresh` is left for the caller to free.
+void Context::resume(Context *fresh, uint64_t last_seq) {
+  int old_id = this->id();
+  // drops the admin API entry under the old id
+  this->touch();
+  // the reconnecting socket was never a separate user, drop it from its rooms unannounced
+  auto fresh_rooms = fresh->rooms;
+  for (auto &room : fresh_rooms) {
+    fresh->leave(room.second, false);
+  }
+  auto nick = NICK_TO_ID.find(fresh->nickname);
+  if (nick != NICK_TO_ID.end() && nick->second == fresh->id()) {
+    NICK_TO_ID.erase(nick);
+  }
+  this->channel = fresh->channel;
+  // the channel's ACTIVE_CONTEXT entry belongs to `this` now
+  fresh->is_active = false;
+
+  ACTIVE_CONTEXT.erase(old_id);
+  ACTIVE_CONTEXT.insert_or_assign(this->id(), this);
+  if (!this->nickname.empty()) {
+    NICK_TO_ID.insert_or_assign(this->nickname, this->id());
+  }
+  for (auto &room : this->rooms) {
+    auto member = room.second->members.extract(old_id);
+    if (!member.empty()) {
+      member.key() = this->id();
+      room.second->members.insert(std::move(member));
+      room.second->unindex_member(old_id);
+      room.second->index_member(this->id());
+      room.second->member_renamed(this);
+    }
+  }
+
+  this->suspended = false;
+  this->touch();
+  this->send(format("resumed @{} ({})", this->nickOrId(), this->id()), CONTROL);
+  for (auto &room : this->rooms) {
+    auto it = this->seen.find(room.first);
+    uint64_t from = it == this->seen.end() ? room.second->seq : it->second;
+    if (room.second == this->room && last_seq < from) {
+      from = last_seq;
+    }
+    room.second->replay(this, from);
+  }
+  this->seen.clear();
+  while (!this->backlog.empty()) {
+    this->send(this->backlog.front());
+    this->dequeue(this->backlog);
+  }
+}
+
+// drop suspended contexts whose grace period has run out
+void expire_sessions() {
+  auto now = chrono::steady_clock::now();
+  for (auto it = SUSPENDED.begin(); it != SUSPENDED.end();) {
+    auto ctx = it->second;
+    if (now - ctx->suspended_at < SESSION_GRACE_PERIOD) {
+      it++;
+      continue;
+    }
+    it = SUSPENDED.erase(it);
+    for (auto &room : ctx->rooms) {
+      room.second->leave(ctx);
+    }
+    auto nick = NICK_TO_ID.find(ctx->nickname);
+    if (nick != NICK_TO_ID.end() && nick->second == ctx->id()) {
+      NICK_TO_ID.erase(nick);
+    }
+    delete ctx;
+  }
+}
+
 // call `room`.join and add room to context room list
 void Context::join(Room *room, RoomPermission perm) {
   auto member = RoomMember{.ctx = this, .permission = perm};
   println("IN JOIN");
   room->join(member);
   this->rooms.insert_or_assign(room->id, room);
+  this->rooms_reply.clear();
 }
 
-void Context::leave(Room *room) {
-  room->leave(this);
+void Context::leave(Room *room, bool announce) {
+  room->leave(this, announce);
   this->rooms.erase(room->id);
+  this->rooms_reply.clear();
 }
 
 enum Command {
@@ -171,29 +576,44 @@ enum Command {
   MEMBERS,
   RENAME,
   MESSAGE,
+  DM,
 
   PERMSET,
+
+  RESUME,
+
+  SEARCH,
 };
 
 static map<string, Command> commands = {
     {"/exit", EXIT},       {"/nickname", NICKNAME}, {"/invite", INVITE},   {"/accept", ACCEPT},
     {"/rooms", ROOMS},     {"/room", ROOM},         {"/message", MESSAGE}, {"/leave", LEAVE},
-    {"/members", MEMBERS}, {"/rename", RENAME},     {"/permset", PERMSET}, {"/commands", COMMANDS}
+    {"/members", MEMBERS}, {"/rename", RENAME},     {"/permset", PERMSET}, {"/commands", COMMANDS},
+    {"/dm", DM},           {"/resume", RESUME},     {"/search", SEARCH},
 };
 
 static Room GLOBAL("global");
-static map<string, int> NICK_TO_ID;
+
+// parse all of `str` as a number, false if it isn't one
+template <typename T> bool parse_number(const string &str, T &value) {
+  auto end = str.data() + str.size();
+  auto res = from_chars(str.data(), end, value);
+  return res.ec == errc() && res.ptr == end;
+}
 
 int parse_id_or_nick(string idOrNick) {
   int id;
+  if (idOrNick.empty()) {
+    return -1;
+  }
   if (idOrNick[0] == '@') {
     auto it = NICK_TO_ID.find(idOrNick.substr(1));
     if (it == NICK_TO_ID.end()) {
       return -1;
     }
     id = it->second;
-  } else {
-    id = stoi(idOrNick);
+  } else if (!parse_number(idOrNick, id)) {
+    return -1;
   }
   return id;
 }
@@ -204,10 +624,13 @@ string handle_command(Context *ctx, Command command, MessageReader *reader) {
       ctx->close();
       return "";
     case COMMANDS: {
-      string commands_list = "Commands:";
-      for (auto &it : commands) {
-        commands_list += "\n  " + it.first;
-      }
+      static const string commands_list = [] {
+        string list = "Commands:";
+        for (auto &it : commands) {
+          list += "\n  " + it.first;
+        }
+        return list;
+      }();
       return commands_list;
     }
     case NICKNAME: {
@@ -221,15 +644,21 @@ string handle_command(Context *ctx, Command command, MessageReader *reader) {
       NICK_TO_ID.erase(ctx->nickname);
       ctx->nickname = nickname;
       NICK_TO_ID.insert({ctx->nickname, ctx->id()});
+      ctx->touch();
+      for (auto &room : ctx->rooms) {
+        room.second->member_renamed(ctx);
+      }
       return "Set nickname: " + nickname;
     }
     case ROOMS: {
-      string rooms = "Rooms:";
-      for (auto &it : ctx->rooms) {
-        auto room = it.second;
-        rooms += "\n  " + format("#{} ({})", room->name, room->id.string());
+      if (ctx->rooms_reply.empty()) {
+        ctx->rooms_reply = "Rooms:";
+        for (auto &it : ctx->rooms) {
+          auto room = it.second;
+          ctx->rooms_reply += "\n  " + format("#{} ({})", room->name, room->id_string);
+        }
       }
-      return rooms;
+      return ctx->rooms_reply;
     }
     case ROOM: {
       string id = trim(reader->read());
@@ -259,7 +688,7 @@ string handle_command(Context *ctx, Command command, MessageReader *reader) {
       if (name.empty()) {
         return "invalid room name";
       }
-      ctx->room->name = name;
+      ctx->room->rename(name);
       ctx->room->broadcast(ctx->room->ctx, format("room name changed to {}", name));
       return "";
     }
@@ -271,9 +700,10 @@ string handle_command(Context *ctx, Command command, MessageReader *reader) {
       if (id < 0) {
         return "no such user";
       }
-      auto member = ctx->room->members.at(id);
+      auto &member = ctx->room->members.at(id);
       member.permission = permission_from_string(reader->read());
-      ctx->room->members[id] = member;
+      ctx->room->touch();
+      member.ctx->touch();
     }
     case INVITE: {
       int id = parse_id_or_nick(trim(reader->read()));
@@ -285,11 +715,20 @@ string handle_command(Context *ctx, Command command, MessageReader *reader) {
         return "no such user";
       }
       auto invite_ctx = recv->second;
+      if (invite_ctx->memory.over_soft()) {
+        return "user can't take more invites";
+      }
+      if (ctx->memory.over_soft()) {
+        return "too many rooms";
+      }
       Room *new_room = new Room(ctx->nickOrId() + "," + invite_ctx->nickOrId());
+      // rooms are never freed, the inviter pays for the room itself while it's connected
+      ctx->memory.charge(sizeof(Room));
       ctx->join(new_room, RoomPermission::Owner);
       println("AFTER JOIN");
       invite_ctx->invites.insert({new_room->id, new_room});
-      invite_ctx->send(std::format("invite from {} ({})", ctx->nickOrId(), new_room->id.string()));
+      invite_ctx->send(std::format("invite from {} ({})", ctx->nickOrId(), new_room->id_string),
+                       CONTROL);
       return "invited";
     }
     case ACCEPT: {
@@ -299,6 +738,9 @@ string handle_command(Context *ctx, Command command, MessageReader *reader) {
         return "no such invite";
       }
       auto room = invite->second;
+      if (room->memory.over_hard()) {
+        return "room is full";
+      }
       cout << "Accept invite Room: " << &room << endl;
       ctx->join(room, RoomPermission::Admin);
       ctx->invites.erase(invite->first);
@@ -326,15 +768,97 @@ string handle_command(Context *ctx, Command command, MessageReader *reader) {
       ctx->room->broadcast(ctx, message);
       return "sent";
     }
+    case DM: {
+      string target = trim(reader->read());
+      if (target.empty()) {
+        string recent = "Recent:";
+        for (int id : ctx->recent) {
+          auto it = ACTIVE_CONTEXT.find(id);
+          if (it != ACTIVE_CONTEXT.end()) {
+            recent += format("\n  @{} ({})", it->second->nickOrId(), id);
+          }
+        }
+        return recent;
+      }
+      int id = parse_id_or_nick(target);
+      if (id < 0) {
+        return "no such user";
+      }
+      auto recv = ACTIVE_CONTEXT.find(id);
+      if (recv == ACTIVE_CONTEXT.end()) {
+        return "no such user";
+      }
+      string message = trim(reader->read_to_end());
+      if (message.empty()) {
+        return "empty message";
+      }
+      ctx->direct(recv->second, message);
+      return "sent";
+    }
+    case RESUME: {
+      string token = trim(reader->read());
+      string last = trim(reader->read());
+      expire_sessions();
+      auto it = SUSPENDED.find(token);
+      if (it == SUSPENDED.end()) {
+        return "no such session";
+      }
+      uint64_t last_seq = UINT64_MAX;
+      if (!last.empty() && !parse_number(last, last_seq)) {
+        return "invalid sequence";
+      }
+      auto session = it->second;
+      SUSPENDED.erase(it);
+      // the resumed context answers for itself, `ctx` is freed by the caller
+      session->resume(ctx, last_seq);
+      return "";
+    }
+    case SEARCH: {
+      if (ctx->room == nullptr) {
+        return "not in a room";
+      }
+      // `/leave` keeps the default room, but its history is no longer ours to read
+      if (!ctx->room->members.contains(ctx->id())) {
+        return "not in room";
+      }
+      string query = trim(reader->read_to_end());
+      if (query.empty()) {
+        return "empty query";
+      }
+      // runs on the search worker, the reply is sent back from this loop
+      auto loop = hv::tlsEventLoop();
+      auto index = ctx->room->index;
+      string header = format("Search #{} \"{}\":", ctx->room->nameOrId(), query);
+      bool queued = SEARCH_WORKER.submit([loop, index, header, query, id = ctx->id()] {
+        string reply = header;
+        auto results = index->search(query, SEARCH_RESULT_LIMIT);
+        if (results.empty()) {
+          reply += " no results";
+        }
+        for (auto &line : results) {
+          reply += "\n  " + line;
+        }
+        loop->runInLoop([id, reply] {
+          auto it = ACTIVE_CONTEXT.find(id);
+          if (it != ACTIVE_CONTEXT.end()) {
+            it->second->send(reply, CONTROL);
+          }
+        });
+      });
+      return queued ? "" : "search busy, try again later";
+    }
     case MEMBERS: {
       if (ctx->room == nullptr) {
         return "not in a room";
       }
-      string members = "Members: ";
-      for (auto it : ctx->room->members) {
-        members += format("\n  @{} ({})", it.second.ctx->nickOrId(), it.second.ctx->id());
+      string offset_str = trim(reader->read());
+      string limit_str = trim(reader->read());
+      size_t offset = 0, limit = MEMBERS_PAGE_LIMIT;
+      if ((!offset_str.empty() && !parse_number(offset_str, offset)) ||
+          (!limit_str.empty() && !parse_number(limit_str, limit))) {
+        return "invalid offset or limit";
       }
-      return members;
+      return ctx->room->members_page(offset, min(limit, MEMBERS_PAGE_LIMIT));
     }
   }
   return "unhandled command";
@@ -343,7 +867,11 @@ string handle_command(Context *ctx, Command command, MessageReader *reader) {
 string dispatch_message(Context *ctx, string message) {
   // cout << "recv: " << message << endl;
   MessageReader reader(message);
-  string command_str = reader.read();
+  string command_str;
+  {
+    TraceSpan span("parse");
+    command_str = reader.read();
+  }
   if (command_str.substr(0, 1) != "/") {
     if (ctx->room == nullptr) {
       return "not in a room";
@@ -351,37 +879,422 @@ string dispatch_message(Context *ctx, string message) {
     ctx->room->broadcast(ctx, message);
     return "sent";
   }
-  auto it = commands.find(command_str);
-  if (it == commands.end()) {
-    return "invalid command";
+  Command command;
+  {
+    TraceSpan span("lookup");
+    auto it = commands.find(command_str);
+    if (it == commands.end()) {
+      return "invalid command";
+    }
+    command = it->second;
   }
-  Command command = it->second;
+  TraceSpan span("handle_command");
   return handle_command(ctx, command, &reader);
 }
 
+shared_ptr<const RoomSnapshot> room_snapshot(Room *room) {
+  vector<MemberSnapshot> members;
+  members.reserve(room->members.size());
+  for (auto &member : room->members) {
+    members.push_back(MemberSnapshot{
+        .id = member.first,
+        .nick = member.second.ctx->nickname,
+        .permission = permission_to_string(member.second.permission),
+    });
+  }
+  return make_shared<const RoomSnapshot>(RoomSnapshot{
+      .id = room->id_string,
+      .name = room->name,
+      .seq = room->seq,
+      .members = std::move(members),
+  });
+}
+
+shared_ptr<const UserSnapshot> user_snapshot(Context *ctx) {
+  vector<UserRoomSnapshot> rooms;
+  for (auto &room : ctx->rooms) {
+    auto member = room.second->members.find(ctx->id());
+    rooms.push_back(UserRoomSnapshot{
+        .id = room.second->id_string,
+        .name = room.second->name,
+        .permission = permission_to_string(
+            member == room.second->members.end() ? None : member->second.permission),
+    });
+  }
+  return make_shared<const UserSnapshot>(UserSnapshot{
+      .id = ctx->id(),
+      .nick = ctx->nickname,
+      .suspended = ctx->suspended,
+      .rooms = std::move(rooms),
+  });
+}
+
+// `previous` with the rooms and users touched since it was built replaced, everything else is
+// shared with it
+shared_ptr<const Snapshot> build_snapshot(const Snapshot &previous, uint64_t epoch) {
+  auto snapshot = make_shared<Snapshot>(previous);
+  snapshot->epoch = epoch;
+  for (auto room : SNAPSHOT_ROOMS) {
+    snapshot->rooms.set(room->id_string, room_snapshot(room));
+  }
+  SNAPSHOT_ROOMS.clear();
+  for (int id : SNAPSHOT_USERS) {
+    auto old = snapshot->users_by_id.find(id);
+    if (old != nullptr) {
+      // unless someone else has taken the nickname since
+      string nick = (*old)->nick;
+      auto by_nick = snapshot->users_by_nick.find(nick);
+      if (by_nick != nullptr && (*by_nick)->id == id) {
+        snapshot->users_by_nick.erase(nick);
+      }
+    }
+    auto it = ACTIVE_CONTEXT.find(id);
+    // gone, or an internal room context
+    if (it == ACTIVE_CONTEXT.end() || !it->second->is_active) {
+      snapshot->users_by_id.erase(id);
+      continue;
+    }
+    auto user = user_snapshot(it->second);
+    snapshot->users_by_id.set(id, user);
+    if (!user->nick.empty()) {
+      snapshot->users_by_nick.set(user->nick, user);
+    }
+  }
+  SNAPSHOT_USERS.clear();
+  snapshot->suspended = SUSPENDED.size();
+  snapshot->connections = snapshot->users_by_id.size() - snapshot->suspended;
+  return snapshot;
+}
+
+static uint64_t SNAPSHOT_EPOCH = 0;
+static chrono::steady_clock::time_point SNAPSHOT_PUBLISHED;
+static bool SNAPSHOT_SCHEDULED = false;
+
+// rebuild and publish the admin API snapshot, at most once per `SNAPSHOT_INTERVAL`
+void publish_snapshot() {
+  if (!SNAPSHOT_DIRTY || SNAPSHOT_SCHEDULED) {
+    return;
+  }
+  auto now = chrono::steady_clock::now();
+  auto wait =
+      chrono::duration_cast<chrono::milliseconds>(SNAPSHOT_PUBLISHED + SNAPSHOT_INTERVAL - now);
+  if (wait.count() > 0) {
+    SNAPSHOT_SCHEDULED = true;
+    hv::tlsEventLoop()->setTimeout(wait.count(), [](hv::TimerID) {
+      SNAPSHOT_SCHEDULED = false;
+      publish_snapshot();
+    });
+    return;
+  }
+  SNAPSHOT_DIRTY = false;
+  SNAPSHOT_PUBLISHED = now;
+  SNAPSHOT.store(build_snapshot(*SNAPSHOT.load(), ++SNAPSHOT_EPOCH));
+}
+
+// a connection whose next message is one of these is served ahead of connections with chat
+// waiting. Each connection's own messages are always handled in the order they arrived.
+static set<Command> control_commands = {PERMSET, INVITE,   ACCEPT, RENAME, MEMBERS,
+                                        ROOMS,   COMMANDS, RESUME, SEARCH};
+
+Lane message_lane(const string &message) {
+  if (message.empty() || message[0] != '/') {
+    return CHAT;
+  }
+  auto it = commands.find(message.substr(0, message.find(' ')));
+  if (it == commands.end() || !control_commands.contains(it->second)) {
+    return CHAT;
+  }
+  return CONTROL;
+}
+
+// messages received on one channel, oldest first
+typedef struct InboundChannel {
+  WebSocketChannelPtr channel;
+  deque<string> messages;
+} InboundChannel;
+
+// per event loop queue of received messages, drained once per loop iteration. Connections
+// take turns, those whose next message is a control command first.
+class InboundQueue {
+public:
+  map<int, InboundChannel> pending;
+  // ids of channels with messages, by the lane of their oldest one
+  deque<int> lanes[LANE_COUNT];
+  bool scheduled = false;
+
+  void push(const WebSocketChannelPtr &channel, const string &message) {
+    auto &in = this->pending[channel->id()];
+    if (in.messages.empty()) {
+      in.channel = channel;
+      this->lanes[message_lane(message)].push_back(channel->id());
+    }
+    in.messages.push_back(message);
+    if (!this->scheduled) {
+      this->scheduled = true;
+      hv::tlsEventLoop()->queueInLoop([this] { this->drain(); });
+    }
+  }
+
+  void drain() {
+    size_t control_streak = 0;
+    for (size_t n = 0; n < INBOUND_BATCH_LIMIT; n++) {
+      Lane lane;
+      if (!this->lanes[CONTROL].empty() &&
+          (this->lanes[CHAT].empty() || control_streak < CONTROL_STREAK_LIMIT)) {
+        lane = CONTROL;
+        control_streak++;
+      } else if (!this->lanes[CHAT].empty()) {
+        lane = CHAT;
+        control_streak = 0;
+      } else {
+        break;
+      }
+      auto pending = this->pending.find(this->lanes[lane].front());
+      this->lanes[lane].pop_front();
+      auto channel = pending->second.channel;
+      string message = std::move(pending->second.messages.front());
+      pending->second.messages.pop_front();
+      if (channel->isClosed()) {
+        this->pending.erase(pending);
+        continue;
+      }
+      if (pending->second.messages.empty()) {
+        this->pending.erase(pending);
+      } else {
+        // back of the line, behind every other connection waiting in that lane
+        this->lanes[message_lane(pending->second.messages.front())].push_back(channel->id());
+      }
+      TraceRequest request("request");
+      auto ctx = Context::build(channel, &GLOBAL);
+      string res = dispatch_message(ctx, message);
+      // `ctx` may be gone by now (`/exit` can close and free it synchronously), look it up again
+      auto it = ACTIVE_CONTEXT.find(channel->id());
+      if (it == ACTIVE_CONTEXT.end()) {
+        continue;
+      }
+      if (it->second != ctx) {
+        // `/resume` handed the channel to a suspended context, `ctx` is retired
+        delete ctx;
+      }
+      // replies share the chat lane so they reach the client in request order
+      if (!res.empty())
+        it->second->send(res);
+    }
+    publish_snapshot();
+    if (this->lanes[CONTROL].empty() && this->lanes[CHAT].empty()) {
+      this->scheduled = false;
+      return;
+    }
+    hv::tlsEventLoop()->queueInLoop([this] { this->drain(); });
+  }
+};
+
+static thread_local InboundQueue INBOUND;
+
+// JSON array body of a chunked response, rendered a chunk at a time as the connection drains
+template <typename C, typename F> class ChunkedJson {
+public:
+  // keeps `items` alive until the response is written
+  shared_ptr<const void> owner;
+  const C &items;
+  typename C::const_iterator next;
+  F render;
+  string chunk;
+  string suffix;
+  bool first = true;
+  bool done = false;
+
+  ChunkedJson(shared_ptr<const void> owner, const C &items, F render, string prefix, string suffix)
+      : owner(owner), items(items), next(items.begin()), render(render), chunk(prefix),
+        suffix(suffix) {}
+
+  // write until the connection has `OUTBOUND_HIGH_WATER` bytes unsent or everything is written
+  void write(HttpResponseWriter *writer) {
+    while (!this->done && writer->writeBufsize() < OUTBOUND_HIGH_WATER) {
+      if (this->next == this->items.end()) {
+        this->chunk += this->suffix;
+        writer->WriteChunked(this->chunk);
+        writer->End();
+        this->done = true;
+        this->owner.reset();
+        break;
+      }
+      if (!this->first) {
+        this->chunk += ',';
+      }
+      this->first = false;
+      this->chunk += this->render(*this->next);
+      ++this->next;
+      if (this->chunk.size() >= SNAPSHOT_CHUNK_SIZE) {
+        writer->WriteChunked(this->chunk);
+        this->chunk.clear();
+      }
+    }
+  }
+};
+
+// write `prefix`, each of `items` rendered by `render` (comma separated) and `suffix` as a
+// chunked response. The rest is written from the writer's write callback once it falls behind,
+// so a large listing neither blocks the loop nor piles up in the write buffer.
+template <typename C, typename F>
+int send_chunked_json(const HttpContextPtr &ctx, shared_ptr<const void> owner,
+                      const string &prefix, const C &items, F render, const string &suffix) {
+  auto writer = ctx->writer;
+  writer->Begin();
+  writer->WriteStatus(HTTP_STATUS_OK);
+  writer->WriteHeader("Content-Type", "application/json");
+  writer->EndHeaders("Transfer-Encoding", "chunked");
+  auto body = make_shared<ChunkedJson<C, F>>(owner, items, render, prefix, suffix);
+  body->write(writer.get());
+  if (!body->done) {
+    writer->onwrite = [body, weak = weak_ptr<HttpResponseWriter>(writer)](hv::Buffer *) {
+      auto writer = weak.lock();
+      if (writer != nullptr && !writer->isClosed()) {
+        body->write(writer.get());
+      }
+    };
+  }
+  return HTTP_STATUS_UNFINISHED;
+}
+
+// read `name` from the environment as a byte count into `bytes`, which is left alone when it's
+// unset. A malformed value stops the server instead of silently becoming a budget of 0.
+void env_bytes(const char *name, size_t &bytes) {
+  const char *value = getenv(name);
+  if (value != nullptr && !parse_number(string(value), bytes)) {
+    println(format("invalid {}: \"{}\", expected a byte count", name, value));
+    exit(1);
+  }
+}
+
 int main(int argc, char **argv) {
+  env_bytes("TOBSCHAT_CONTEXT_MEMORY_SOFT", CONTEXT_MEMORY_BUDGET.soft);
+  env_bytes("TOBSCHAT_CONTEXT_MEMORY_HARD", CONTEXT_MEMORY_BUDGET.hard);
+  env_bytes("TOBSCHAT_ROOM_MEMORY_SOFT", ROOM_MEMORY_BUDGET.soft);
+  env_bytes("TOBSCHAT_ROOM_MEMORY_HARD", ROOM_MEMORY_BUDGET.hard);
+  env_bytes("TOBSCHAT_SEARCH_INDEX_MEMORY", SEARCH_INDEX_BUDGET);
+
   HttpService http;
   http.GET("/", [](const HttpContextPtr &ctx) { return ctx->send("hello world!"); });
+  // ?seconds=N returns spans from the last N seconds, ?sample=N traces one in N requests
+  http.GET("/debug/trace", [](const HttpContextPtr &ctx) {
+    string sample = ctx->param("sample");
+    if (!sample.empty()) {
+      TRACER.sample_every = atoi(sample.c_str());
+    }
+    int seconds = atoi(ctx->param("seconds", "10").c_str());
+    return ctx->send(TRACER.export_json(max(seconds, 0)), APPLICATION_JSON);
+  });
+
+  // read-only admin API, served from the last published snapshot. Memory use is only reported
+  // in aggregate by /api/memory, which reads the live counters.
+  http.GET("/api/rooms", [](const HttpContextPtr &ctx) {
+    auto snapshot = SNAPSHOT.load();
+    string prefix = format("{{\"epoch\":{},\"connections\":{},\"suspended\":{},\"rooms\":[",
+                           snapshot->epoch, snapshot->connections, snapshot->suspended);
+    return send_chunked_json(ctx, snapshot, prefix, snapshot->rooms,
+                             [](auto &room) { return json_room(*room.second); }, "]}");
+  });
+  http.GET("/api/rooms/:uuid/members", [](const HttpContextPtr &ctx) {
+    auto snapshot = SNAPSHOT.load();
+    auto room = snapshot->rooms.find(ctx->param("uuid"));
+    if (room == nullptr) {
+      ctx->setStatus(HTTP_STATUS_NOT_FOUND);
+      return ctx->send("{\"error\":\"no such room\"}", APPLICATION_JSON);
+    }
+    auto &members = (*room)->members;
+    return send_chunked_json(
+        ctx, *room,
+        format("{{\"epoch\":{},\"room\":{},\"members\":[", snapshot->epoch, json_room(**room)),
+        members, json_member, "]}");
+  });
+  http.GET("/api/memory", [](const HttpContextPtr &ctx) {
+    return ctx->send(
+        format("{{\"contexts\":{{\"bytes\":{},\"soft\":{},\"hard\":{}}},"
+               "\"rooms\":{{\"bytes\":{},\"soft\":{},\"hard\":{}}},"
+               "\"indexes\":{{\"bytes\":{},\"budget\":{}}}}}",
+               MEMORY_TOTALS.contexts.load(), CONTEXT_MEMORY_BUDGET.soft,
+               CONTEXT_MEMORY_BUDGET.hard, MEMORY_TOTALS.rooms.load(), ROOM_MEMORY_BUDGET.soft,
+               ROOM_MEMORY_BUDGET.hard, SEARCH_INDEX_BYTES.load(), SEARCH_INDEX_BUDGET),
+        APPLICATION_JSON);
+  });
+  http.GET("/api/users/:nick", [](const HttpContextPtr &ctx) {
+    auto snapshot = SNAPSHOT.load();
+    auto user = snapshot->users_by_nick.find(ctx->param("nick"));
+    if (user == nullptr) {
+      ctx->setStatus(HTTP_STATUS_NOT_FOUND);
+      return ctx->send("{\"error\":\"no such user\"}", APPLICATION_JSON);
+    }
+    return ctx->send(json_user(**user), APPLICATION_JSON);
+  });
+  // users without a nickname
+  http.GET("/api/users/id/:id", [](const HttpContextPtr &ctx) {
+    auto snapshot = SNAPSHOT.load();
+    int id;
+    const shared_ptr<const UserSnapshot> *user = nullptr;
+    if (parse_number(ctx->param("id"), id)) {
+      user = snapshot->users_by_id.find(id);
+    }
+    if (user == nullptr) {
+      ctx->setStatus(HTTP_STATUS_NOT_FOUND);
+      return ctx->send("{\"error\":\"no such user\"}", APPLICATION_JSON);
+    }
+    return ctx->send(json_user(**user), APPLICATION_JSON);
+  });
 
   WebSocketService ws;
 
   ws.onopen = [](const WebSocketChannelPtr &channel, const HttpRequestPtr &req) {
     println(format("connected: @{}", channel->id()));
-    Context::build(channel, &GLOBAL);
+    static thread_local bool sweeping = false;
+    if (!sweeping) {
+      sweeping = true;
+      hv::tlsEventLoop()->setInterval(SESSION_SWEEP_INTERVAL.count(), [](hv::TimerID) {
+        expire_sessions();
+        publish_snapshot();
+      });
+    }
+    expire_sessions();
+    auto ctx = Context::build(channel, &GLOBAL);
+    publish_snapshot();
+    ctx->send("session: " + ctx->token, CONTROL);
+    // flush from the loop rather than from inside the write that drained the buffer
+    channel->onwrite = [id = channel->id()](hv::Buffer *) {
+      auto it = ACTIVE_CONTEXT.find(id);
+      if (it == ACTIVE_CONTEXT.end() ||
+          (it->second->outbound[CONTROL].empty() && it->second->outbound[CHAT].empty())) {
+        return;
+      }
+      hv::tlsEventLoop()->queueInLoop([id] {
+        auto it = ACTIVE_CONTEXT.find(id);
+        if (it != ACTIVE_CONTEXT.end()) {
+          it->second->flush();
+        }
+      });
+    };
   };
 
   ws.onmessage = [](const WebSocketChannelPtr &channel, const string &message) {
-    auto ctx = Context::build(channel, &GLOBAL);
-    string res = dispatch_message(ctx, message);
-    if (!res.empty())
-      ctx->send(res);
+    INBOUND.push(channel, message);
   };
 
   ws.onclose = [](const WebSocketChannelPtr &channel) {
-    auto ctx = Context::build(channel, nullptr);
+    auto it = ACTIVE_CONTEXT.find(channel->id());
+    if (it == ACTIVE_CONTEXT.end()) {
+      return;
+    }
+    auto ctx = it->second;
     println(format("disconnected: @{}", ctx->id()));
-    ACTIVE_CONTEXT.erase(ctx->id());
-    delete ctx;
+    if (ctx->exited) {
+      NICK_TO_ID.erase(ctx->nickname);
+      ACTIVE_CONTEXT.erase(ctx->id());
+      delete ctx;
+    } else {
+      ctx->suspend();
+    }
+    expire_sessions();
+    SNAPSHOT_DIRTY = true;
+    publish_snapshot();
   };
 
   WebSocketServer server;
@@ -0,0 +1,77 @@
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+// bytes charged to all accounts of one kind, readable from any thread
+typedef struct MemoryTotals {
+  atomic<size_t> contexts = 0;
+  atomic<size_t> rooms = 0;
+} MemoryTotals;
+
+inline MemoryTotals MEMORY_TOTALS;
+
+// past `soft` bytes an account's owner stops taking on optional data (invites, history), past
+// `hard` it sheds what it can
+typedef struct MemoryBudget {
+  size_t soft;
+  size_t hard;
+} MemoryBudget;
+
+// bytes held on behalf of one context or room
+class MemoryAccount {
+public:
+  atomic<size_t> *total;
+  const MemoryBudget *budget;
+  size_t bytes = 0;
+
+  MemoryAccount(atomic<size_t> *total, const MemoryBudget *budget)
+      : total(total), budget(budget) {}
+  MemoryAccount(const MemoryAccount &) = delete;
+  ~MemoryAccount() { this->total->fetch_sub(this->bytes, memory_order_relaxed); }
+
+  void charge(size_t n) {
+    this->bytes += n;
+    this->total->fetch_add(n, memory_order_relaxed);
+  }
+  void release(size_t n) {
+    this->bytes -= n;
+    this->total->fetch_sub(n, memory_order_relaxed);
+  }
+
+  bool over_soft() { return this->bytes > this->budget->soft; }
+  bool over_hard() { return this->bytes > this->budget->hard; }
+};
+
+// std allocator that charges every allocation to a MemoryAccount
+template <typename T> class AccountingAllocator {
+public:
+  typedef T value_type;
+  MemoryAccount *account;
+
+  AccountingAllocator(MemoryAccount *account) : account(account) {}
+  template <typename U>
+  AccountingAllocator(const AccountingAllocator<U> &other) : account(other.account) {}
+
+  T *allocate(size_t n) {
+    T *p = allocator<T>().allocate(n);
+    this->account->charge(n * sizeof(T));
+    return p;
+  }
+  void deallocate(T *p, size_t n) {
+    this->account->release(n * sizeof(T));
+    allocator<T>().deallocate(p, n);
+  }
+
+  template <typename U> bool operator==(const AccountingAllocator<U> &other) const {
+    return this->account == other.account;
+  }
+};
+
+template <typename K, typename V>
+using accounted_map = map<K, V, less<K>, AccountingAllocator<pair<const K, V>>>;
+template <typename T> using accounted_deque = deque<T, AccountingAllocator<T>>;
+template <typename T> using accounted_vector = vector<T, AccountingAllocator<T>>;
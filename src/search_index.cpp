@@ -0,0 +1,312 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+
+// documents per segment, the unit of eviction
+const size_t SEARCH_SEGMENT_DOCS = 4096;
+// segments are also sealed early once they hold this many bytes
+const size_t SEARCH_SEGMENT_BYTES = 1024 * 1024;
+// terms longer than this are truncated
+const size_t SEARCH_TERM_MAX = 32;
+// results returned by one query
+const size_t SEARCH_RESULT_LIMIT = 20;
+// queries waiting for the worker before new ones are refused
+const size_t SEARCH_QUEUE_LIMIT = 64;
+
+// bytes all indexes together may hold before the oldest segments are dropped
+inline size_t SEARCH_INDEX_BUDGET = 256 * 1024 * 1024;
+// bytes held by all indexes
+inline atomic<size_t> SEARCH_INDEX_BYTES = 0;
+
+// lowercased alphanumeric runs of two or more characters, without duplicates
+inline vector<string> search_terms(const string &text) {
+  vector<string> terms;
+  unordered_set<string> seen;
+  string term;
+  for (size_t i = 0; i <= text.size(); i++) {
+    unsigned char c = i < text.size() ? text[i] : ' ';
+    if (isalnum(c)) {
+      if (term.size() < SEARCH_TERM_MAX) {
+        term += tolower(c);
+      }
+      continue;
+    }
+    if (term.size() >= 2 && seen.insert(term).second) {
+      terms.push_back(term);
+    }
+    term.clear();
+  }
+  return terms;
+}
+
+// ascending document numbers, stored as varint encoded deltas
+class PostingList {
+public:
+  vector<uint8_t> bytes;
+  uint32_t last = 0;
+  uint32_t count = 0;
+
+  void add(uint32_t doc) {
+    uint32_t delta = this->count == 0 ? doc : doc - this->last;
+    while (delta >= 0x80) {
+      this->bytes.push_back(uint8_t(delta) | 0x80);
+      delta >>= 7;
+    }
+    this->bytes.push_back(uint8_t(delta));
+    this->last = doc;
+    this->count++;
+  }
+
+  vector<uint32_t> decode() const {
+    vector<uint32_t> docs;
+    docs.reserve(this->count);
+    uint32_t doc = 0, delta = 0;
+    int shift = 0;
+    for (uint8_t byte : this->bytes) {
+      delta |= uint32_t(byte & 0x7f) << shift;
+      if (byte & 0x80) {
+        shift += 7;
+        continue;
+      }
+      doc += delta;
+      docs.push_back(doc);
+      delta = 0;
+      shift = 0;
+    }
+    return docs;
+  }
+};
+
+// up to `SEARCH_SEGMENT_DOCS` messages and their postings, immutable once sealed
+class SearchSegment {
+public:
+  vector<string> lines;
+  unordered_map<string, PostingList> postings;
+  size_t bytes = 0;
+
+  void add(const string &text, const string &line) {
+    uint32_t doc = this->lines.size();
+    for (auto &term : search_terms(text)) {
+      auto it = this->postings.find(term);
+      if (it == this->postings.end()) {
+        it = this->postings.emplace(term, PostingList()).first;
+        this->bytes += sizeof(PostingList) + term.capacity() + 32;
+      }
+      size_t before = it->second.bytes.capacity();
+      it->second.add(doc);
+      this->bytes += it->second.bytes.capacity() - before;
+    }
+    this->lines.push_back(line);
+    this->bytes += sizeof(string) + line.capacity();
+  }
+
+  bool full() {
+    return this->lines.size() >= SEARCH_SEGMENT_DOCS || this->bytes >= SEARCH_SEGMENT_BYTES;
+  }
+
+  // lines containing every term, newest first
+  void match(const vector<string> &terms, size_t limit, vector<string> &out) const {
+    vector<const PostingList *> lists;
+    for (auto &term : terms) {
+      auto it = this->postings.find(term);
+      if (it == this->postings.end()) {
+        return;
+      }
+      lists.push_back(&it->second);
+    }
+    sort(lists.begin(), lists.end(),
+         [](const PostingList *a, const PostingList *b) { return a->count < b->count; });
+    auto docs = lists[0]->decode();
+    for (size_t i = 1; i < lists.size() && !docs.empty(); i++) {
+      auto other = lists[i]->decode();
+      vector<uint32_t> both;
+      set_intersection(docs.begin(), docs.end(), other.begin(), other.end(),
+                       back_inserter(both));
+      docs = std::move(both);
+    }
+    for (auto it = docs.rbegin(); it != docs.rend() && out.size() < limit; it++) {
+      out.push_back(this->lines[*it]);
+    }
+  }
+};
+
+class SearchIndex;
+
+// sealed segments of every index, oldest first, so the budget is enforced across rooms
+class SearchSegments {
+public:
+  // taken before an index's own lock, never after
+  mutex lock;
+  deque<weak_ptr<SearchIndex>> sealed;
+
+  void add(const shared_ptr<SearchIndex> &index) {
+    lock_guard<mutex> guard(this->lock);
+    this->sealed.push_back(index);
+  }
+
+  // drop the oldest sealed segment of any index, false if there is none
+  bool evict();
+};
+
+inline SearchSegments SEARCH_SEGMENTS;
+
+// inverted index over one room's messages, appended to by the room's event loop and queried
+// from the search worker
+class SearchIndex : public enable_shared_from_this<SearchIndex> {
+public:
+  // guards `sealed` and `active`, sealed segments themselves are read without it
+  mutex lock;
+  deque<shared_ptr<const SearchSegment>> sealed;
+  shared_ptr<SearchSegment> active = make_shared<SearchSegment>();
+  size_t sealed_bytes = 0;
+
+  ~SearchIndex() {
+    SEARCH_INDEX_BYTES.fetch_sub(this->sealed_bytes + this->active->bytes, memory_order_relaxed);
+  }
+
+  void add(const string &text, const string &line) {
+    bool full;
+    {
+      lock_guard<mutex> guard(this->lock);
+      size_t before = this->active->bytes;
+      this->active->add(text, line);
+      SEARCH_INDEX_BYTES.fetch_add(this->active->bytes - before, memory_order_relaxed);
+      full = this->active->full();
+    }
+    if (full) {
+      this->seal();
+    }
+    while (SEARCH_INDEX_BYTES.load(memory_order_relaxed) > SEARCH_INDEX_BUDGET) {
+      // once only active segments are left, seal ours so it can be dropped
+      if (!SEARCH_SEGMENTS.evict() && !this->seal()) {
+        break;
+      }
+    }
+  }
+
+  // move the active segment to `sealed`, false if it's empty
+  bool seal() {
+    {
+      lock_guard<mutex> guard(this->lock);
+      if (this->active->lines.empty()) {
+        return false;
+      }
+      this->sealed_bytes += this->active->bytes;
+      this->sealed.push_back(std::move(this->active));
+      this->active = make_shared<SearchSegment>();
+    }
+    SEARCH_SEGMENTS.add(shared_from_this());
+    return true;
+  }
+
+  void evict_oldest() {
+    lock_guard<mutex> guard(this->lock);
+    if (this->sealed.empty()) {
+      return;
+    }
+    this->sealed_bytes -= this->sealed.front()->bytes;
+    SEARCH_INDEX_BYTES.fetch_sub(this->sealed.front()->bytes, memory_order_relaxed);
+    this->sealed.pop_front();
+  }
+
+  // up to `limit` lines matching every term of `query`, newest first
+  vector<string> search(const string &query, size_t limit) {
+    vector<string> results;
+    auto terms = search_terms(query);
+    if (terms.empty()) {
+      return results;
+    }
+    vector<shared_ptr<const SearchSegment>> segments;
+    {
+      lock_guard<mutex> guard(this->lock);
+      this->active->match(terms, limit, results);
+      segments.assign(this->sealed.rbegin(), this->sealed.rend());
+    }
+    for (auto &segment : segments) {
+      if (results.size() >= limit) {
+        break;
+      }
+      segment->match(terms, limit, results);
+    }
+    return results;
+  }
+};
+
+inline bool SearchSegments::evict() {
+  lock_guard<mutex> guard(this->lock);
+  while (!this->sealed.empty()) {
+    auto index = this->sealed.front().lock();
+    this->sealed.pop_front();
+    if (index != nullptr) {
+      index->evict_oldest();
+      return true;
+    }
+  }
+  return false;
+}
+
+// single background thread running search queries off the event loops
+class SearchWorker {
+public:
+  mutex lock;
+  condition_variable wake;
+  deque<function<void()>> jobs;
+  bool stopping = false;
+  thread worker;
+
+  ~SearchWorker() {
+    {
+      lock_guard<mutex> guard(this->lock);
+      this->stopping = true;
+    }
+    this->wake.notify_one();
+    if (this->worker.joinable()) {
+      this->worker.join();
+    }
+  }
+
+  // false if `SEARCH_QUEUE_LIMIT` queries are already waiting
+  bool submit(function<void()> job) {
+    {
+      lock_guard<mutex> guard(this->lock);
+      if (this->jobs.size() >= SEARCH_QUEUE_LIMIT) {
+        return false;
+      }
+      if (!this->worker.joinable()) {
+        this->worker = thread([this] { this->run(); });
+      }
+      this->jobs.push_back(std::move(job));
+    }
+    this->wake.notify_one();
+    return true;
+  }
+
+  void run() {
+    while (true) {
+      function<void()> job;
+      {
+        unique_lock<mutex> guard(this->lock);
+        this->wake.wait(guard, [this] { return this->stopping || !this->jobs.empty(); });
+        if (this->stopping) {
+          return;
+        }
+        job = std::move(this->jobs.front());
+        this->jobs.pop_front();
+      }
+      job();
+    }
+  }
+};
+
+inline SearchWorker SEARCH_WORKER;
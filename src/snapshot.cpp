@@ -0,0 +1,193 @@
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <format>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// bytes rendered before a chunk is written to the response
+const size_t SNAPSHOT_CHUNK_SIZE = 16 * 1024;
+
+typedef struct MemberSnapshot {
+  int id;
+  string nick;
+  string permission;
+} MemberSnapshot;
+
+typedef struct RoomSnapshot {
+  string id;
+  string name;
+  uint64_t seq;
+  vector<MemberSnapshot> members;
+} RoomSnapshot;
+
+typedef struct UserRoomSnapshot {
+  string id;
+  string name;
+  string permission;
+} UserRoomSnapshot;
+
+typedef struct UserSnapshot {
+  int id;
+  string nick;
+  bool suspended;
+  vector<UserRoomSnapshot> rooms;
+} UserSnapshot;
+
+// map split into buckets by key hash. A copy shares every bucket with the original and copies
+// one only when it's first written, so a new version costs what changed.
+template <typename K, typename V> class SnapshotTable {
+public:
+  static const size_t BUCKETS = 256;
+  array<shared_ptr<map<K, V>>, BUCKETS> buckets;
+  size_t count = 0;
+  // buckets this copy owns and may write in place
+  bitset<BUCKETS> owned;
+
+  SnapshotTable() {
+    auto empty = make_shared<map<K, V>>();
+    this->buckets.fill(empty);
+  }
+  SnapshotTable(const SnapshotTable &other) : buckets(other.buckets), count(other.count) {}
+
+  static size_t bucket(const K &key) { return hash<K>()(key) % BUCKETS; }
+
+  size_t size() const { return this->count; }
+
+  // nullptr if `key` isn't in the table
+  const V *find(const K &key) const {
+    auto &entries = *this->buckets[bucket(key)];
+    auto it = entries.find(key);
+    return it == entries.end() ? nullptr : &it->second;
+  }
+
+  void set(const K &key, V value) {
+    auto &entries = this->write(bucket(key));
+    if (entries.insert_or_assign(key, std::move(value)).second) {
+      this->count++;
+    }
+  }
+
+  void erase(const K &key) {
+    if (this->find(key) != nullptr) {
+      this->write(bucket(key)).erase(key);
+      this->count--;
+    }
+  }
+
+  map<K, V> &write(size_t bucket) {
+    if (!this->owned[bucket]) {
+      this->buckets[bucket] = make_shared<map<K, V>>(*this->buckets[bucket]);
+      this->owned[bucket] = true;
+    }
+    return *this->buckets[bucket];
+  }
+
+  // every entry, bucket by bucket
+  class const_iterator {
+  public:
+    const SnapshotTable *table;
+    size_t bucket;
+    typename map<K, V>::const_iterator it;
+
+    const pair<const K, V> &operator*() const { return *this->it; }
+    const_iterator &operator++() {
+      this->it++;
+      this->skip_empty();
+      return *this;
+    }
+    bool operator==(const const_iterator &other) const {
+      return this->bucket == other.bucket && (this->bucket == BUCKETS || this->it == other.it);
+    }
+
+    void skip_empty() {
+      while (this->bucket < BUCKETS && this->it == this->table->buckets[this->bucket]->end()) {
+        if (++this->bucket < BUCKETS) {
+          this->it = this->table->buckets[this->bucket]->begin();
+        }
+      }
+    }
+  };
+
+  const_iterator begin() const {
+    const_iterator it{this, 0, this->buckets[0]->begin()};
+    it.skip_empty();
+    return it;
+  }
+  const_iterator end() const { return const_iterator{this, BUCKETS, {}}; }
+};
+
+// immutable copy of the chat registries, built on an event loop and read from anywhere
+class Snapshot {
+public:
+  uint64_t epoch = 0;
+  size_t connections = 0;
+  size_t suspended = 0;
+  // by room id
+  SnapshotTable<string, shared_ptr<const RoomSnapshot>> rooms;
+  SnapshotTable<int, shared_ptr<const UserSnapshot>> users_by_id;
+  // users with a nickname
+  SnapshotTable<string, shared_ptr<const UserSnapshot>> users_by_nick;
+};
+
+inline atomic<shared_ptr<const Snapshot>> SNAPSHOT{make_shared<const Snapshot>()};
+
+inline string json_escape(const string &str) {
+  string escaped;
+  escaped.reserve(str.size() + 2);
+  escaped += '"';
+  for (unsigned char c : str) {
+    switch (c) {
+      case '"':
+        escaped += "\\\"";
+        break;
+      case '\\':
+        escaped += "\\\\";
+        break;
+      case '\n':
+        escaped += "\\n";
+        break;
+      case '\r':
+        escaped += "\\r";
+        break;
+      case '\t':
+        escaped += "\\t";
+        break;
+      default:
+        if (c < 0x20) {
+          escaped += format("\\u{:04x}", c);
+        } else {
+          escaped += c;
+        }
+    }
+  }
+  escaped += '"';
+  return escaped;
+}
+
+inline string json_member(const MemberSnapshot &member) {
+  return format("{{\"id\":{},\"nick\":{},\"permission\":{}}}", member.id,
+                json_escape(member.nick), json_escape(member.permission));
+}
+
+inline string json_room(const RoomSnapshot &room) {
+  return format("{{\"id\":{},\"name\":{},\"seq\":{},\"members\":{}}}", json_escape(room.id),
+                json_escape(room.name), room.seq, room.members.size());
+}
+
+inline string json_user(const UserSnapshot &user) {
+  string json = format("{{\"id\":{},\"nick\":{},\"suspended\":{},\"rooms\":[", user.id,
+                       json_escape(user.nick), user.suspended ? "true" : "false");
+  for (size_t i = 0; i < user.rooms.size(); i++) {
+    auto &room = user.rooms[i];
+    json += format("{}{{\"id\":{},\"name\":{},\"permission\":{}}}", i == 0 ? "" : ",",
+                   json_escape(room.id), json_escape(room.name), json_escape(room.permission));
+  }
+  json += "]}";
+  return json;
+}
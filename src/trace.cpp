@@ -0,0 +1,149 @@
+#include <atomic>
+#include <chrono>
+#include <format>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// spans kept per thread, older ones are overwritten
+const size_t TRACE_RING_SIZE = 16 * 1024;
+
+typedef struct TraceEvent {
+  // string literal, never freed
+  const char *name;
+  uint64_t start_us;
+  uint64_t duration_us;
+} TraceEvent;
+
+inline uint64_t trace_now_us() {
+  return chrono::duration_cast<chrono::microseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+class TraceRing {
+public:
+  int tid;
+  // only contended while exporting
+  mutex lock;
+  vector<TraceEvent> events;
+  size_t written = 0;
+
+  TraceRing(int tid) : tid(tid), events(TRACE_RING_SIZE) {}
+
+  void record(TraceEvent event) {
+    lock_guard<mutex> guard(this->lock);
+    this->events[this->written % TRACE_RING_SIZE] = event;
+    this->written++;
+  }
+
+  void collect(uint64_t since_us, vector<TraceEvent> &out) {
+    lock_guard<mutex> guard(this->lock);
+    size_t count = min(this->written, TRACE_RING_SIZE);
+    for (size_t i = this->written - count; i < this->written; i++) {
+      auto &event = this->events[i % TRACE_RING_SIZE];
+      if (event.start_us >= since_us) {
+        out.push_back(event);
+      }
+    }
+  }
+};
+
+class Tracer {
+public:
+  // trace one in `sample_every` requests, 0 disables tracing
+  atomic<uint32_t> sample_every = 100;
+  atomic<uint64_t> requests = 0;
+  mutex lock;
+  vector<shared_ptr<TraceRing>> rings;
+
+  // the calling thread's ring, registered on first use and kept after the thread exits
+  TraceRing *ring() {
+    thread_local shared_ptr<TraceRing> ring = [this] {
+      lock_guard<mutex> guard(this->lock);
+      auto ring = make_shared<TraceRing>(this->rings.size() + 1);
+      this->rings.push_back(ring);
+      return ring;
+    }();
+    return ring.get();
+  }
+
+  bool sample() {
+    uint32_t every = this->sample_every.load(memory_order_relaxed);
+    return every != 0 && this->requests.fetch_add(1, memory_order_relaxed) % every == 0;
+  }
+
+  // spans started in the last `seconds` as Chrome trace-event JSON
+  string export_json(uint64_t seconds) {
+    vector<shared_ptr<TraceRing>> rings;
+    {
+      lock_guard<mutex> guard(this->lock);
+      rings = this->rings;
+    }
+    uint64_t now = trace_now_us();
+    uint64_t since = now > seconds * 1000000 ? now - seconds * 1000000 : 0;
+    string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    vector<TraceEvent> events;
+    for (auto &ring : rings) {
+      events.clear();
+      ring->collect(since, events);
+      for (auto &event : events) {
+        if (!first) {
+          json += ',';
+        }
+        first = false;
+        json += format("{{\"name\":\"{}\",\"ph\":\"X\",\"ts\":{},\"dur\":{},\"pid\":1,\"tid\":{}}}",
+                       event.name, event.start_us, event.duration_us, ring->tid);
+      }
+    }
+    json += "]}";
+    return json;
+  }
+};
+
+inline Tracer TRACER;
+// whether the request being handled on this thread is sampled
+inline thread_local bool TRACE_SAMPLED = false;
+
+// records the time until it goes out of scope, if the current request is sampled
+class TraceSpan {
+public:
+  const char *name;
+  bool recording;
+  uint64_t start_us = 0;
+
+  TraceSpan(const char *name) : name(name), recording(TRACE_SAMPLED) {
+    if (this->recording) {
+      this->start_us = trace_now_us();
+    }
+  }
+  ~TraceSpan() {
+    if (this->recording) {
+      TRACER.ring()->record(TraceEvent{
+          .name = this->name,
+          .start_us = this->start_us,
+          .duration_us = trace_now_us() - this->start_us,
+      });
+    }
+  }
+};
+
+class TraceSampling {
+public:
+  TraceSampling() { TRACE_SAMPLED = TRACER.sample(); }
+  ~TraceSampling() { TRACE_SAMPLED = false; }
+};
+
+// root span of a request, decides whether the spans nested in it are recorded
+class TraceRequest {
+public:
+  // declared first so sampling ends after `span` is recorded
+  TraceSampling sampling;
+  TraceSpan span;
+
+  TraceRequest(const char *name) : span(name) {}
+};